@@ -0,0 +1,334 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "bundle.h"
+#include "input_loader.h"
+#include "packet.h"
+#ifdef HAS_SERIAL
+#include "bootloader_interface.h"
+
+#include <atomic>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#endif
+
+using namespace std::literals;
+namespace fs = std::filesystem;
+
+namespace {
+  struct Options {
+    std::vector<std::size_t> sizes {1 << 20, 16 << 20, 256 << 20, 1 << 30};
+    std::size_t max_transfer = 16 << 20;
+    std::uint32_t baud = 0; // 0: don't throttle the simulated device
+    std::chrono::duration<double> min_time = 200ms;
+    fs::path dir = fs::temp_directory_path();
+  };
+
+  std::size_t parse_size(std::string_view str) {
+    std::size_t pos;
+    std::size_t size = std::stoull(std::string(str), &pos);
+    str.remove_prefix(pos);
+    if (str == "K"sv) size <<= 10;
+    else if (str == "M"sv) size <<= 20;
+    else if (str == "G"sv) size <<= 30;
+    else if (!str.empty()) throw "Invalid size suffix (use K, M or G)";
+    return size;
+  }
+
+  // Deterministic pseudo random data, so runs are comparable
+  void fill(std::span<char> data, std::uint64_t seed) {
+    for (auto &c : data) {
+      seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+      c = seed;
+    }
+  }
+
+  std::vector<char> make_packet(std::uint8_t type, std::size_t image_size, std::uint64_t seed) {
+    std::vector<char> packet(packetHeaderSize + image_size);
+    auto image = std::span{packet}.subspan(packetHeaderSize);
+    fill(image, seed);
+    buildPacketHeader(std::span{packet}.first<packetHeaderSize>(), type, "Snapmaker_Bench", 0, 20,
+                      image.size(), packetChecksum(image), 1);
+    return packet;
+  }
+
+  // Roughly `size` bytes in total: half controller, a quarter module and a quarter screen
+  Update make_update(std::size_t size) {
+    Update update;
+    update.version = "Snapmaker2_Bench";
+    update.flags = 1;
+    update.controller = make_packet(0, std::max(size / 2, packetHeaderSize) - packetHeaderSize, 1);
+    update.modules.push_back(make_packet(1, std::max(size / 4, packetHeaderSize) - packetHeaderSize, 2));
+    auto &screen = update.screen.emplace(std::max<std::size_t>(size - size / 2 - size / 4, 2));
+    fill(screen, 3);
+    screen[0] = 'P'; screen[1] = 'K';
+    return update;
+  }
+
+  // Peak RSS in KiB since the last call. Linux allows resetting the high water mark, elsewhere
+  // this is the peak of the whole process.
+  long peak_rss() {
+    long peak = -1;
+    {
+      std::ifstream status("/proc/self/status");
+      for (std::string line; std::getline(status, line);)
+        if (line.starts_with("VmHWM:"))
+          peak = std::stol(line.substr(6));
+    }
+    if (peak < 0) {
+      rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+      peak = usage.ru_maxrss;
+    }
+    std::ofstream("/proc/self/clear_refs") << "5";
+    return peak;
+  }
+
+  void print_heading() {
+    std::cout << std::left << std::setw(20) << "# benchmark" << std::right
+              << std::setw(12) << "size"
+              << std::setw(16) << "ns/op"
+              << std::setw(12) << "MiB/s"
+              << std::setw(14) << "peak_rss_KiB" << '\n';
+  }
+
+  // Runs `fn` until `min_time` has passed (at least once) and reports the fastest run.
+  void measure(const Options &options, std::string_view name, std::size_t size, std::size_t bytes, const std::function<void()> &fn) {
+    using clock = std::chrono::steady_clock;
+    peak_rss();
+    auto best = clock::duration::max();
+    auto total = clock::duration::zero();
+    do {
+      auto start = clock::now();
+      fn();
+      auto elapsed = clock::now() - start;
+      best = std::min(best, elapsed);
+      total += elapsed;
+    } while (total < options.min_time);
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(best).count();
+    std::cout << std::left << std::setw(20) << name << std::right
+              << std::setw(12) << size
+              << std::setw(16) << ns
+              << std::setw(12) << std::fixed << std::setprecision(3) << (ns ? bytes * 1e9 / ns / (1 << 20) : 0.)
+              << std::setw(14) << peak_rss() << std::endl;
+  }
+
+  template<typename T>
+  void keep(const T &value) {
+    asm volatile("" : : "g"(&value) : "memory");
+  }
+
+#ifdef HAS_SERIAL
+  // Answers every bootloader message arriving on the master side of a pty, optionally limited
+  // to the speed of a serial line with `baud` bits per second (8N1, so 10 bits per byte).
+  class SimulatedDevice {
+    public:
+      SimulatedDevice(std::uint32_t baud): baud(baud) {
+        master = posix_openpt(O_RDWR | O_NOCTTY);
+        if (master < 0 || grantpt(master) || unlockpt(master))
+          throw "Unable to create pseudo terminal";
+        slave_path = ptsname(master);
+      }
+      SimulatedDevice(const SimulatedDevice&) = delete;
+      ~SimulatedDevice() {
+        stop = true;
+        if (worker.joinable())
+          worker.join();
+        close(master);
+      }
+      void start() { worker = std::thread([this] { run(); }); }
+      const std::string &path() const { return slave_path; }
+
+    private:
+      bool read_exact(std::uint8_t *data, std::size_t size) {
+        while (size) {
+          pollfd fd{master, POLLIN, 0};
+          if (poll(&fd, 1, 50) <= 0) {
+            if (stop) return false;
+            continue;
+          }
+          auto count = read(master, data, size);
+          if (count <= 0)
+            return false;
+          data += count; size -= count;
+        }
+        return true;
+      }
+      void throttle(std::size_t bytes) {
+        if (!baud) return;
+        deadline += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(bytes * 10.0 / baud));
+        std::this_thread::sleep_until(deadline);
+      }
+      void run() {
+        deadline = std::chrono::steady_clock::now();
+        std::uint8_t c = 0;
+        std::array<std::uint8_t, 6> header;
+        std::vector<std::uint8_t> data;
+        while (true) {
+          do {
+            if (!read_exact(&c, 1)) return;
+          } while (c != 0x55);
+          if (!read_exact(header.data(), header.size())) return;
+          data.resize(header[0] << 8 | header[1]);
+          if (!read_exact(data.data(), data.size())) return;
+          throttle(2 + header.size() + data.size());
+
+          std::array<std::uint8_t, 2> response{0xa9, 0x01};
+          std::uint16_t length = htobe16(response.size());
+          std::uint16_t checksum = snapmaker::bootloader::calc_checksum(response);
+          std::array<std::uint8_t, 8> reply_header{0xAA, 0x55, 0, 0, 0, std::uint8_t(response.size()), 0, 0};
+          std::copy_n((std::uint8_t*)&length, 2, reply_header.begin() + 2);
+          std::copy_n((std::uint8_t*)&checksum, 2, reply_header.begin() + 6);
+          throttle(reply_header.size() + response.size());
+          if (write(master, reply_header.data(), reply_header.size()) < 0
+              || write(master, response.data(), response.size()) < 0)
+            return;
+        }
+      }
+
+      std::uint32_t baud;
+      int master;
+      std::string slave_path;
+      std::atomic<bool> stop = false;
+      std::thread worker;
+      std::chrono::steady_clock::time_point deadline;
+  };
+
+  void transfer(const Options &options, std::span<const std::uint8_t> data) {
+    SimulatedDevice device(options.baud);
+    serial::Serial serial{device.path(), options.baud ? options.baud : 115200, serial::Timeout::simpleTimeout(10000)};
+    device.start();
+    // BlockwiseSender prints progress for every block
+    auto clog_buf = std::clog.rdbuf(nullptr);
+    try {
+      snapmaker::bootloader::send_buffer(serial, data);
+    } catch (...) {
+      std::clog.rdbuf(clog_buf);
+      throw;
+    }
+    std::clog.rdbuf(clog_buf);
+  }
+#endif
+
+  void run(const Options &options, std::size_t size) {
+    auto update = make_update(size);
+    std::vector<char> buffer;
+    measure(options, "serialize", size, getSize(update), [&] { buffer = serialize(update); });
+
+    {
+      auto path = options.dir / ("snapmaker-bench-" + std::to_string(getpid()) + ".bin");
+      write_file(path.c_str(), buffer);
+      measure(options, "read_file", size, buffer.size(), [&] { keep(read_file(path.c_str())); });
+      fs::remove(path);
+    }
+
+    {
+      std::vector<std::vector<char>*> components{&*update.controller, &update.modules.front(), &*update.screen};
+      std::vector<std::string> paths;
+      std::size_t total = 0;
+      for (auto component : components) {
+        paths.push_back(options.dir / ("snapmaker-bench-" + std::to_string(getpid()) + "-" + std::to_string(paths.size()) + ".bin"));
+        write_file(paths.back().c_str(), *component);
+        total += component->size();
+      }
+      std::vector<const char*> names;
+      for (auto &path : paths)
+        names.push_back(path.c_str());
+      measure(options, "read_file_each", size, total, [&] {
+        for (auto name : names)
+          keep(read_file(name));
+      });
+      for (auto [name, backend] : {std::pair{"InputLoader", InputLoader::Backend::Auto},
+                                   std::pair{"InputLoader_pread", InputLoader::Backend::Pread}})
+        measure(options, name, size, total, [&] {
+          InputLoader inputs(names, backend);
+          for (std::size_t i = 0; i != inputs.size(); ++i)
+            keep(inputs.get(i));
+        });
+      for (auto &path : paths)
+        fs::remove(path);
+    }
+
+    measure(options, "parseHeader", size, headerSize(3), [&] { keep(parseHeader(buffer)); });
+    measure(options, "parseUpdate", size, buffer.size(), [&] { keep(parseUpdate(buffer)); });
+
+    auto image = std::span<const char>{*update.controller}.subspan(packetHeaderSize);
+    measure(options, "package_header", size, image.size(), [&] {
+      char header[packetHeaderSize];
+      buildPacketHeader(header, 0, "Snapmaker_Bench", 0, 20, image.size(), packetChecksum(image), 1);
+      keep(header);
+    });
+
+#ifdef HAS_SERIAL
+    std::span<const std::uint8_t> bytes{(const std::uint8_t*)buffer.data(), buffer.size()};
+    measure(options, "calc_checksum", size, bytes.size(), [&] { keep(snapmaker::bootloader::calc_checksum(bytes)); });
+    if (size <= options.max_transfer) {
+      auto data = bytes.first(std::min(size, bytes.size()));
+      auto name = options.baud ? "transfer@" + std::to_string(options.baud) : "transfer"s;
+      measure(options, name, size, data.size(), [&] { transfer(options, data); });
+    }
+#endif
+  }
+}
+
+int main(int argc, char const* argv[]) try {
+  Options options;
+  while(argv[1]) {
+    std::string_view arg = argv[1];
+    if (arg.starts_with("--sizes=")) {
+      arg.remove_prefix(sizeof("--sizes=")-1);
+      options.sizes.clear();
+      while (!arg.empty()) {
+        auto pos = arg.find(',');
+        options.sizes.push_back(parse_size(arg.substr(0, pos)));
+        arg.remove_prefix(pos == arg.npos ? arg.size() : pos + 1);
+      }
+    } else if (arg.starts_with("--max-transfer=")) {
+      arg.remove_prefix(sizeof("--max-transfer=")-1);
+      options.max_transfer = parse_size(arg);
+    } else if (arg.starts_with("--baud=")) {
+      arg.remove_prefix(sizeof("--baud=")-1);
+      options.baud = std::stoul(std::string(arg));
+    } else if (arg.starts_with("--min-time=")) {
+      arg.remove_prefix(sizeof("--min-time=")-1);
+      options.min_time = std::chrono::duration<double>(std::stod(std::string(arg)));
+    } else if (arg.starts_with("--dir=")) {
+      arg.remove_prefix(sizeof("--dir=")-1);
+      options.dir = arg;
+    } else {
+      std::cerr << "Usage: ./benchmark [--sizes=1M,16M,256M,1G] [--max-transfer=16M] [--baud=0] [--min-time=0.2] [--dir=/tmp]\n";
+      return 1;
+    }
+    ++argv; --argc;
+  }
+
+  print_heading();
+  for (auto size : options.sizes)
+    run(options, size);
+  return 0;
+} catch(const char *str) {
+  std::cerr << "FATAL ERROR: " << str << '\n';
+  return 1;
+} catch(std::exception &ex) {
+  std::cerr << "FATAL ERROR: " << ex.what() << '\n';
+  return 1;
+}
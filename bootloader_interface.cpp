@@ -16,6 +16,15 @@ using namespace std::string_view_literals;
 
 namespace snapmaker::bootloader {
 
+  std::uint16_t calc_checksum(std::span<const std::uint8_t> data) {
+    std::uint32_t init = data.size() % 2 ? data.back() : 0;
+    std::span<const std::uint16_t> evendata((const std::uint16_t*)data.data(), data.size()/2);
+    std::uint32_t checksum = std::transform_reduce(evendata.begin(), evendata.end(), init, std::plus<>(), [](auto i) { return be16toh(i); });
+    while (checksum >= 0x10000)
+      checksum = (checksum >> 16) + (checksum & 0xffff);
+    return htobe16(~checksum);
+  }
+
   namespace {
     struct Header {
       std::uint8_t magic0 = 0xAA;
@@ -37,15 +46,6 @@ namespace snapmaker::bootloader {
       }
     };
     static_assert(sizeof(Header) == 8);
-
-    std::uint16_t calc_checksum(std::span<const std::uint8_t> data) {
-      std::uint32_t init = data.size() % 2 ? data.back() : 0;
-      std::span<const std::uint16_t> evendata((const std::uint16_t*)data.data(), data.size()/2);
-      std::uint32_t checksum = std::transform_reduce(evendata.begin(), evendata.end(), init, std::plus<>(), [](auto i) { return be16toh(i); });
-      while (checksum >= 0x10000)
-        checksum = (checksum >> 16) + (checksum & 0xffff);
-      return htobe16(~checksum);
-    }
     void send_message(serial::Serial &serial, std::span<const std::uint8_t> data) {
       Header header;
       header.set_length(data.size());
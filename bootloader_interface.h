@@ -28,6 +28,8 @@ namespace snapmaker::bootloader {
       decltype(buffer)::iterator iter = buffer.begin() + 4;
       std::uint16_t count = 0;
   };
+  // Checksum used by the bootloader message framing (already in network byte order)
+  std::uint16_t calc_checksum(std::span<const std::uint8_t> data);
   void keep_alive(serial::Serial &serial);
   void announce(serial::Serial &serial, std::string_view version);
   void unlock_and_erase(serial::Serial &serial);
@@ -0,0 +1,197 @@
+#include "bundle.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+#include "endian-helper.h"
+
+Header parseHeader(std::span<const char> buffer) {
+  if(buffer.size() < headerSize(0))
+    throw "Buffer too small to contain header";
+  auto iter = buffer.begin();
+  std::uint16_t length = be16toh(*(std::uint16_t*)&*iter);
+  if(length > buffer.size())
+    throw "Header length exceeds buffer size";
+  iter += 2; length -= 2;
+
+  Header header;
+
+  header.version = [&] {
+    auto end_iter = iter + 32;
+    while(end_iter != iter && !*(end_iter - 1))
+      --end_iter;
+    return std::string(iter, end_iter);
+  }();
+  iter += 32; length -= 32;
+
+  header.flags = be32toh(*(std::uint32_t*)&*iter);
+  iter += 4; length -= 4;
+
+  header.entries.resize(*iter);
+  iter += 1; length -= 1;
+  if (length < header.entries.size() * 9)
+    throw "Too many entries for specified header size";
+  for (Header::Entry &entry : header.entries) {
+    entry.type = Header::Type(*iter);
+    iter += 1;
+    entry.offset = be32toh(*(std::uint32_t*)&*iter);
+    iter += 4; length -= 4;
+    entry.size = be32toh(*(std::uint32_t*)&*iter);
+    iter += 4; length -= 4;
+  }
+  return header;
+}
+Update parseUpdate(std::span<const char> buffer) {
+  Update update;
+  auto header = parseHeader(buffer);
+  update.version = std::move(header.version);
+  update.flags = header.flags;
+  for (auto &&entry : header.entries) {
+    if (entry.offset + entry.size > buffer.size())
+      throw "Length inconsistency detected";
+    auto &container = [&](Header::Type type) -> auto& {
+      switch(type) {
+        case Header::Type::Controller:
+          if (update.controller)
+            throw "Duplicate Controller packet";
+          return update.controller.emplace();
+        case Header::Type::Module:
+          update.modules.emplace_back();
+          return update.modules.back();
+        case Header::Type::Screen:
+          if (update.screen)
+            throw "Duplicate Screen packet";
+          return update.screen.emplace();
+        default: throw "Unknown entry type";
+      }
+    }(entry.type);
+    container.resize(entry.size);
+    auto begin_iter = buffer.begin() + entry.offset;
+    std::copy(begin_iter, begin_iter + entry.size, container.begin());
+  }
+  return update;
+}
+
+std::size_t getSize(const Update &update) {
+  std::size_t size = 0;
+  std::size_t packets = update.modules.size();
+  for (auto &&module : update.modules) {
+    size += module.size();
+  }
+  if (update.controller) {
+    size += update.controller->size(); ++packets;
+  }
+  if (update.screen) {
+    size += update.screen->size(); ++packets;
+  }
+  return size + headerSize(packets);
+}
+std::span<char> serialize(const Header &header, std::span<char> buffer) {
+  auto header_size = headerSize(header.entries.size());
+  if (buffer.size() < header_size)
+    throw "Buffer too small to hold header";
+  if (header.version.size() > 32)
+    throw "Version too long";
+  if (header.entries.size() >= 0x100)
+    throw "Too many entries in update header";
+  *reinterpret_cast<std::uint16_t*>(buffer.data()) = htobe16(header_size);
+  buffer = buffer.subspan<2>();
+  std::fill(
+      std::copy(header.version.begin(), header.version.end(), buffer.begin()),
+      buffer.begin() + 32,
+      0);
+  buffer = buffer.subspan<32>();
+  *reinterpret_cast<std::uint32_t*>(buffer.data()) = htobe32(header.flags);
+  buffer = buffer.subspan<4>();
+  buffer.front() = header.entries.size();
+  buffer = buffer.subspan<1>();
+  for (auto &&entry : header.entries) {
+    buffer.front() = (char)entry.type;
+    buffer = buffer.subspan<1>();
+    *reinterpret_cast<std::uint32_t*>(buffer.data()) = htobe32(entry.offset);
+    buffer = buffer.subspan<4>();
+    *reinterpret_cast<std::uint32_t*>(buffer.data()) = htobe32(entry.size);
+    buffer = buffer.subspan<4>();
+  }
+  return buffer;
+}
+Header makeHeader(std::string version, std::uint32_t flags, std::vector<Header::Entry> entries) {
+  Header header;
+  header.version = std::move(version);
+  header.flags = flags;
+  header.entries = std::move(entries);
+  std::uint32_t offset = headerSize(header.entries.size());
+  for (auto &entry : header.entries) {
+    entry.offset = offset;
+    offset += entry.size;
+  }
+  return header;
+}
+Header makeHeader(const Update &update) {
+  std::vector<Header::Entry> entries;
+  for (auto &&module : update.modules)
+    entries.push_back(Header::Entry(Header::Type::Module, 0, module.size()));
+  if (update.controller)
+    entries.push_back(Header::Entry(Header::Type::Controller, 0, update.controller->size()));
+  if (update.screen)
+    entries.push_back(Header::Entry(Header::Type::Screen, 0, update.screen->size()));
+  return makeHeader(update.version, update.flags, std::move(entries));
+}
+std::span<char> serialize(const Update &update, std::span<char> buffer) {
+  auto header = makeHeader(update);
+  if (buffer.size() < (header.entries.empty() ? headerSize(0) : header.entries.back().offset + header.entries.back().size))
+    throw "Buffer too small to hold update";
+  buffer = serialize(header, buffer);
+  for (auto &&module : update.modules) {
+    std::copy(module.begin(), module.end(), buffer.begin());
+    buffer = buffer.subspan(module.size());
+  }
+  if (update.controller) {
+    std::copy(update.controller->begin(), update.controller->end(), buffer.begin());
+    buffer = buffer.subspan(update.controller->size());
+  }
+  if (update.screen) {
+    std::copy(update.screen->begin(), update.screen->end(), buffer.begin());
+    buffer = buffer.subspan(update.screen->size());
+  }
+  return buffer;
+}
+std::vector<char> serialize(const Update &update) {
+  std::vector<char> buffer(getSize(update));
+  serialize(update, buffer);
+  return buffer;
+}
+
+std::vector<char> read_file(const char *filename, Sha256 *digest) {
+  std::ifstream file(filename, std::ios_base::in | std::ios_base::binary);
+  // Start with the exact size if we know it, the buffer only has to grow for pipes etc.
+  std::error_code ec;
+  auto expected = std::filesystem::file_size(filename, ec);
+  std::vector<char> buffer(ec ? 0x10000 : expected);
+  std::size_t used = 0;
+  constexpr std::size_t chunk_size = 0x100000;
+  while (file) {
+    if (used == buffer.size()) {
+      // Only grow if there really is more data (unknown size or the file grew), otherwise we would allocate twice
+      // the file size for nothing
+      if (file.peek() == std::ifstream::traits_type::eof())
+        break;
+      buffer.resize(std::max<std::size_t>(buffer.size() * 2, 0x10000));
+    }
+    file.read(buffer.data() + used, std::min(chunk_size, buffer.size() - used));
+    auto chunk = std::span{buffer}.subspan(used, file.gcount());
+    if (digest)
+      digest->update(chunk);
+    used += chunk.size();
+  }
+  buffer.resize(used);
+  return buffer;
+}
+
+void write_file(const char *filename, const std::vector<char> &data) {
+  std::ofstream file(filename, std::ios_base::out | std::ios_base::binary);
+  if (!file)
+    throw "Unable to open output file\n";
+  file.write(data.data(), data.size());
+}
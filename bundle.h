@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "sha256.h"
+
+struct Header {
+  enum class Type {
+    Controller = 0,
+    Module = 1,
+    Screen = 2
+  };
+  struct Entry {
+    Type type;
+    std::uint32_t offset;
+    std::uint32_t size;
+  };
+  std::string version;
+  std::uint32_t flags;
+  std::vector<Entry> entries;
+};
+
+struct Update {
+  std::string version;
+  std::uint32_t flags = 0;
+  std::optional<std::vector<char>> screen;
+  std::optional<std::vector<char>> controller;
+  std::vector<std::vector<char>> modules;
+};
+
+constexpr std::size_t headerSize(std::size_t entries) noexcept {
+  return 2 + 32 + 4 + 1 + 9 * entries;
+}
+
+Header parseHeader(std::span<const char> buffer);
+Update parseUpdate(std::span<const char> buffer);
+std::size_t getSize(const Update &update);
+std::span<char> serialize(const Header &header, std::span<char> buffer);
+// Assigns consecutive offsets to the entries in the given order
+Header makeHeader(std::string version, std::uint32_t flags, std::vector<Header::Entry> entries);
+Header makeHeader(const Update &update);
+std::span<char> serialize(const Update &update, std::span<char> buffer);
+std::vector<char> serialize(const Update &update);
+
+std::vector<char> read_file(const char *filename, Sha256 *digest = nullptr);
+void write_file(const char *filename, const std::vector<char> &data);
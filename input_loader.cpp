@@ -0,0 +1,414 @@
+#include "input_loader.h"
+
+#ifdef HAS_PREAD
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#define HAS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+namespace {
+  // Reads are split in pieces of this size, so large files don't occupy a single request forever and all inputs
+  // make progress at the same time.
+  constexpr std::size_t chunkSize = 0x1000000;
+
+  // For pipes and other files without a known size
+  std::vector<char> read_stream(int fd, const char *&error) {
+    std::vector<char> data(0x10000);
+    std::size_t used = 0;
+    while (true) {
+      if (used == data.size())
+        data.resize(data.size() * 2);
+      auto result = read(fd, data.data() + used, data.size() - used);
+      if (result < 0 && errno == EINTR)
+        continue;
+      if (result < 0)
+        error = "Unable to read input file";
+      if (result <= 0)
+        break;
+      used += result;
+    }
+    data.resize(used);
+    return data;
+  }
+}
+
+#ifdef HAS_IO_URING
+struct InputLoader::Ring {
+  int fd = -1;
+  void *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED;
+  std::size_t sq_len = 0, cq_len = 0;
+  io_uring_sqe *sqes = (io_uring_sqe*)MAP_FAILED;
+  std::size_t sqes_len = 0;
+  unsigned entries = 0;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_cqe *cqes;
+
+  std::vector<iovec> iovecs;       // One per request, they have to stay valid until the request completes
+  unsigned in_flight = 0;          // Including the queued ones
+  std::deque<std::size_t> queued;  // Requests in the submission queue which the kernel didn't consume yet
+
+  static std::unique_ptr<Ring> create(unsigned entries) {
+    io_uring_params params {};
+    auto ring = std::make_unique<Ring>();
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+      return nullptr;
+    ring->entries = params.sq_entries;
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+      ring->sq_len = ring->cq_len = std::max(ring->sq_len, ring->cq_len);
+    ring->sq_ptr = mmap(nullptr, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+      return nullptr;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+      ring->cq_ptr = ring->sq_ptr;
+    else {
+      ring->cq_ptr = mmap(nullptr, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if (ring->cq_ptr == MAP_FAILED)
+        return nullptr;
+    }
+    ring->sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+    ring->sqes = (io_uring_sqe*)mmap(nullptr, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+      return nullptr;
+
+    auto sq = (char*)ring->sq_ptr, cq = (char*)ring->cq_ptr;
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    return ring;
+  }
+  Ring() = default;
+  Ring(const Ring&) = delete;
+  ~Ring() {
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_len);
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+    if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_len);
+    if (fd >= 0) close(fd);
+  }
+
+  // Moves pending requests into the submission queue (we never have more than `entries` requests in flight, so
+  // the completion queue can't overflow either).
+  void queue(std::vector<File> &files, std::vector<Request> &requests, std::deque<std::size_t> &pending) {
+    while (!pending.empty() && in_flight != entries) {
+      auto index = pending.front();
+      pending.pop_front();
+      auto &request = requests[index];
+      iovecs[index] = {files[request.file].data.data() + request.offset, request.length};
+
+      unsigned tail = *sq_tail;
+      unsigned slot = tail & *sq_mask;
+      auto &sqe = sqes[slot];
+      std::memset(&sqe, 0, sizeof sqe);
+      sqe.opcode = IORING_OP_READV;
+      sqe.fd = files[request.file].fd;
+      sqe.addr = (std::uint64_t)&iovecs[index];
+      sqe.len = 1;
+      sqe.off = request.offset;
+      sqe.user_data = index;
+      sq_array[slot] = slot;
+      std::atomic_ref{*sq_tail}.store(tail + 1, std::memory_order_release);
+      ++in_flight;
+      queued.push_back(index);
+    }
+  }
+
+  // Submits everything queued and, if `wait` is set, blocks until at least one request completed.
+  // Returns false if the ring is unusable. Requests which were submitted before might still be in flight then.
+  bool enter(bool wait) {
+    if (queued.empty() && !wait)
+      return true;
+    auto result = syscall(__NR_io_uring_enter, fd, queued.size(), wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (result < 0)
+      return errno == EINTR || errno == EAGAIN || errno == EBUSY;
+    queued.erase(queued.begin(), queued.begin() + result);
+    return true;
+  }
+
+  template<typename F>
+  void reap(F &&handle) {
+    unsigned head = *cq_head;
+    unsigned tail = std::atomic_ref{*cq_tail}.load(std::memory_order_acquire);
+    for (; head != tail; ++head) {
+      auto &cqe = cqes[head & *cq_mask];
+      --in_flight;
+      handle(cqe.user_data, cqe.res);
+    }
+    std::atomic_ref{*cq_head}.store(head, std::memory_order_release);
+  }
+};
+#else
+struct InputLoader::Ring {};
+#endif
+
+InputLoader::InputLoader(std::span<const char *const> filenames, Backend backend): files(filenames.size()) {
+  // If anything fails, reads might already be in flight
+  try {
+    start(filenames, backend);
+  } catch (...) {
+    shutdown();
+    throw;
+  }
+}
+
+void InputLoader::start(std::span<const char *const> filenames, Backend backend) {
+  std::vector<std::size_t> streams;
+  for (std::size_t i = 0; i != files.size(); ++i) {
+    auto &file = files[i];
+    file.fd = open(filenames[i], O_RDONLY);
+    if (file.fd < 0)
+      throw "Unable to open input file";
+    struct stat info;
+    if (fstat(file.fd, &info))
+      throw "Unable to stat input file";
+    if (!S_ISREG(info.st_mode)) {
+      streams.push_back(i);
+      continue;
+    }
+    file.size = info.st_size;
+    file.data.resize(file.size);
+    if (file.size)
+      requests.push_back({i, 0, std::min(file.size, headSize), true});
+    else
+      file.head_done = true;
+  }
+  // Interleave the remaining chunks of all files until prioritize() tells us in which order they are needed
+  for (std::uint64_t offset = headSize; ; offset += chunkSize) {
+    bool any = false;
+    for (std::size_t i = 0; i != files.size(); ++i)
+      if (files[i].data.size() > offset) {
+        requests.push_back({i, offset, std::min(files[i].data.size() - offset, chunkSize), false});
+        any = true;
+      }
+    if (!any) break;
+  }
+  for (std::size_t i = 0; i != requests.size(); ++i) {
+    ++files[requests[i].file].outstanding;
+    pending.push_back(i);
+  }
+
+#ifdef HAS_IO_URING
+  if (!requests.empty() && backend == Backend::Auto)
+    ring = Ring::create(64);
+  if (ring) {
+    ring->iovecs.resize(requests.size());
+    ring->queue(files, requests, pending);
+    if (!ring->enter(false))
+      fall_back({});
+  } else
+#endif
+    start_workers();
+
+  // These are read here while the other reads are already in progress
+  for (auto i : streams) {
+    auto &file = files[i];
+    const char *error = nullptr;
+    auto data = read_stream(file.fd, error);
+    std::lock_guard lock(mutex);
+    file.data = std::move(data);
+    file.size = file.data.size();
+    file.error = error;
+    file.head_done = true;
+  }
+}
+
+InputLoader::~InputLoader() {
+  shutdown();
+}
+
+// Stops issuing reads and waits until neither the kernel nor a worker can still write into our buffers.
+void InputLoader::shutdown() noexcept {
+  {
+    std::lock_guard lock(mutex);
+    pending.clear();
+  }
+#ifdef HAS_IO_URING
+  if (ring) {
+    while (ring->in_flight) {
+      if (!ring->enter(true)) {
+        // We can't tell when the kernel is done with the buffers (and iovecs), so rather leak them than let it
+        // write into freed memory.
+        for (auto &file : files)
+          new std::vector<char>(std::move(file.data));
+        ring.release();
+        break;
+      }
+      ring->reap([](std::size_t, int) {});
+    }
+  }
+#endif
+  for (auto &worker : workers)
+    worker.join();
+  workers.clear();
+  for (auto &file : files)
+    if (file.fd >= 0) {
+      close(file.fd);
+      file.fd = -1;
+    }
+}
+
+void InputLoader::complete(Request &request, long result) {
+  auto &file = files[request.file];
+  if (result < 0)
+    file.error = "Unable to read input file";
+  else if (std::size_t(result) < request.length)
+    file.eof = std::min<std::size_t>(file.eof, request.offset + result);
+  if (request.head)
+    file.head_done = true;
+  if (--file.outstanding)
+    return;
+  // Make sure we didn't miss anything that got appended after the file size was determined
+  struct stat info;
+  if (file.eof < file.data.size())
+    file.data.resize(file.eof);
+  if (!file.error && (file.eof != SIZE_MAX || fstat(file.fd, &info) || std::size_t(info.st_size) != file.size))
+    file.error = "Input file changed while reading";
+}
+
+void InputLoader::start_workers() {
+  std::size_t count = std::count_if(files.begin(), files.end(), [](auto &file) { return file.outstanding; });
+  count = std::min<std::size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+  for (std::size_t i = 0; i != count; ++i)
+    workers.emplace_back([this] { run_worker(); });
+}
+
+#ifdef HAS_IO_URING
+// Returns false if the request failed because io_uring (or this kind of file) doesn't support it
+bool InputLoader::reaped(std::size_t index, int result) {
+  auto &request = requests[index];
+  if (result == -EOPNOTSUPP || result == -EINVAL || result == -ENOSYS)
+    return false;
+  if (result == -EINTR || result == -EAGAIN) {
+    pending.push_front(index);
+  } else if (result > 0 && std::size_t(result) < request.length) {
+    // Short read, continue where it stopped
+    request.offset += result;
+    request.length -= result;
+    pending.push_front(index);
+  } else
+    complete(request, result);
+  return true;
+}
+
+// Hands everything that is left to the pread workers once the kernel is done with the requests it already took
+void InputLoader::fall_back(std::vector<std::size_t> failed) {
+  ring->in_flight -= ring->queued.size();
+  pending.insert(pending.begin(), ring->queued.begin(), ring->queued.end());
+  ring->queued.clear();
+  while (ring->in_flight) {
+    if (!ring->enter(true))
+      throw "Unable to read input file";
+    ring->reap([&](std::size_t index, int result) {
+      if (!reaped(index, result))
+        failed.push_back(index);
+    });
+  }
+  pending.insert(pending.begin(), failed.begin(), failed.end());
+  ring.reset();
+  start_workers();
+}
+#endif
+
+void InputLoader::wait_for(const std::function<bool()> &done) {
+#ifdef HAS_IO_URING
+  while (ring && !done()) {
+    ring->queue(files, requests, pending);
+    bool usable = ring->enter(true);
+    std::vector<std::size_t> failed;
+    ring->reap([&](std::size_t index, int result) {
+      if (!reaped(index, result))
+        failed.push_back(index);
+    });
+    if (!usable || !failed.empty())
+      fall_back(std::move(failed));
+  }
+  if (ring)
+    return;
+#endif
+  std::unique_lock lock(mutex);
+  cv.wait(lock, done);
+}
+
+void InputLoader::prioritize(std::span<const std::size_t> order) {
+  std::vector<std::size_t> rank(files.size(), order.size());
+  for (std::size_t i = 0; i != order.size(); ++i)
+    rank[order[i]] = i;
+  std::lock_guard lock(mutex);
+  std::stable_sort(pending.begin(), pending.end(), [&](auto a, auto b) {
+    return rank[requests[a].file] < rank[requests[b].file];
+  });
+}
+
+void InputLoader::run_worker() {
+  while (true) {
+    std::size_t index;
+    {
+      std::lock_guard lock(mutex);
+      if (pending.empty())
+        return;
+      index = pending.front();
+      pending.pop_front();
+    }
+    auto &request = requests[index];
+    auto &file = files[request.file];
+    long result = 0;
+    auto *data = file.data.data() + request.offset;
+    while (std::size_t(result) < request.length) {
+      auto count = pread(file.fd, data + result, request.length - result, request.offset + result);
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count < 0)
+        result = -1;
+      if (count <= 0)
+        break;
+      result += count;
+    }
+    {
+      std::lock_guard lock(mutex);
+      complete(request, result);
+    }
+    cv.notify_all();
+  }
+}
+
+std::span<const char> InputLoader::head(std::size_t index) {
+  auto &file = files[index];
+  // Fetch the error inside the predicate: the pread workers might still be working on other chunks of this file,
+  // so it must only be read while the lock is held.
+  const char *error = nullptr;
+  wait_for([&] { error = file.error; return file.head_done; });
+  if (error)
+    throw error;
+  // Don't look at data.size() here, the worker might still shrink it if the file got truncated
+  return {file.data.data(), std::min(headSize, file.size)};
+}
+
+std::vector<char> &InputLoader::get(std::size_t index) {
+  auto &file = files[index];
+  const char *error = nullptr;
+  wait_for([&] { error = file.error; return file.head_done && !file.outstanding; });
+  if (error)
+    throw error;
+  return file.data;
+}
+
+#endif
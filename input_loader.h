@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+// MinGW ships <unistd.h>, but without pread
+#if __has_include(<unistd.h>) && !defined(_WIN32)
+#define HAS_PREAD
+#else
+#include "bundle.h"
+#endif
+
+#ifdef HAS_PREAD
+// Reads several input files concurrently.
+//
+// Every file is stat'ed first so its buffer can be allocated with the exact size, then the reads for all files are
+// submitted at once: Through io_uring where available, otherwise through a small pool of pread worker threads.
+// This way reading N files takes about as long as reading the slowest of them and the caller can already process
+// (e.g. write out) the files which are done while the others are still loading.
+class InputLoader {
+  public:
+    // Number of bytes at the start of every file which are read first, so that the type of all inputs can be
+    // determined quickly.
+    static constexpr std::size_t headSize = 0x1000;
+
+    enum class Backend {
+      Auto,  // io_uring if the kernel supports it (falls back to pread if it doesn't work for the inputs)
+      Pread,
+    };
+
+    explicit InputLoader(std::span<const char *const> filenames, Backend backend = Backend::Auto);
+    InputLoader(const InputLoader&) = delete;
+    ~InputLoader();
+
+    std::size_t size() const noexcept { return files.size(); }
+    // Size reported by stat. get() fails if the file is found to be truncated or extended while it is being read.
+    std::size_t file_size(std::size_t index) const noexcept { return files[index].size; }
+    // Blocks until the first min(headSize, file_size(index)) bytes of the file are available.
+    std::span<const char> head(std::size_t index);
+    // Blocks until the file has been read completely. The buffer can be moved out.
+    std::vector<char> &get(std::size_t index);
+    // Reads the remaining chunks file by file in the given order (files which are not listed come last), so the
+    // first files are complete early instead of all files finishing at about the same time. Up to the io_uring
+    // queue depth (or the number of workers) chunks are still read concurrently.
+    void prioritize(std::span<const std::size_t> order);
+
+  private:
+    struct File {
+      int fd = -1;
+      std::size_t size = 0;
+      std::vector<char> data;
+      std::size_t outstanding = 0; // Read requests which did not complete yet
+      bool head_done = false;
+      std::size_t eof = SIZE_MAX; // Offset at which the file ended early
+      const char *error = nullptr;
+    };
+    struct Request {
+      std::size_t file;
+      std::uint64_t offset;
+      std::size_t length;
+      bool head;
+    };
+
+    void start(std::span<const char *const> filenames, Backend backend);
+    void start_workers();
+    bool reaped(std::size_t index, int result);
+    void fall_back(std::vector<std::size_t> failed);
+    void wait_for(const std::function<bool()> &done);
+    void complete(Request &request, long result);
+    void run_worker();
+    void shutdown() noexcept;
+
+    std::vector<File> files;
+    std::vector<Request> requests;
+    std::deque<std::size_t> pending; // Requests which were not submitted/picked by a worker yet
+
+    // io_uring backend (see input_loader.cpp), nullptr if not available
+    struct Ring;
+    std::unique_ptr<Ring> ring;
+
+    // pread backend
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+#else
+// Without POSIX I/O the inputs are simply read one after another with read_file()
+class InputLoader {
+  public:
+    static constexpr std::size_t headSize = 0x1000;
+
+    enum class Backend {
+      Auto,
+      Pread,
+    };
+
+    explicit InputLoader(std::span<const char *const> filenames, Backend = Backend::Auto) {
+      for (auto filename : filenames)
+        files.push_back(read_file(filename));
+    }
+
+    std::size_t size() const noexcept { return files.size(); }
+    std::size_t file_size(std::size_t index) const noexcept { return files[index].size(); }
+    std::span<const char> head(std::size_t index) {
+      return std::span<const char>{files[index]}.first(std::min(headSize, files[index].size()));
+    }
+    std::vector<char> &get(std::size_t index) { return files[index]; }
+    void prioritize(std::span<const std::size_t>) {}
+
+  private:
+    std::vector<std::vector<char>> files;
+};
+#endif
@@ -0,0 +1,44 @@
+#ifndef MANIFEST_HELPER
+#define MANIFEST_HELPER
+
+#include <initializer_list>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "sha256.h"
+
+// Quote a string for the JSON manifests written by `--manifest=`
+inline std::string json_string(std::string_view str) {
+  constexpr char digits[] = "0123456789abcdef";
+  std::string result = "\"";
+  for (unsigned char c : str) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if (c < 0x20) {
+      result += "\\u00";
+      result += digits[c >> 4];
+      result += digits[c & 0xf];
+    } else
+      result += c;
+  }
+  return result + '"';
+}
+
+// Write data in chunks, feeding each chunk into the digests (null entries are skipped) while it is still in cache
+// instead of hashing the whole buffer in a separate pass.
+inline void write_hashed(std::ostream &out, std::span<const char> data, std::initializer_list<Sha256*> digests) {
+  constexpr std::size_t chunk_size = 0x10000;
+  while (!data.empty()) {
+    auto chunk = data.first(std::min(chunk_size, data.size()));
+    for (auto digest : digests)
+      if (digest)
+        digest->update(chunk);
+    out.write(chunk.data(), chunk.size());
+    data = data.subspan(chunk.size());
+  }
+}
+
+#endif
@@ -1,14 +1,16 @@
 #include <ios>
 #include <iostream>
 #include <fstream>
-#include <sstream>
+#include <span>
+#include <string>
 #include <vector>
-#include <numeric>
 #include <string_view>
 #include <thread>
 #include <chrono>
 
 #include "endian-helper.h"
+#include "packet.h"
+#include "manifest-helper.h"
 #ifdef HAS_SERIAL
 #include "bootloader_interface.h"
 #endif
@@ -16,9 +18,10 @@
 using namespace std::literals;
 
 int main(int argc, char const* argv[]) try {
-  std::uint32_t flags;
+  std::uint32_t flags = 0;
   std::ifstream input;
   std::ofstream output;
+  std::ofstream manifest;
   const char *flash_interface = nullptr;
   while(argv[1]) {
     std::string_view arg = argv[1];
@@ -41,6 +44,13 @@ int main(int argc, char const* argv[]) try {
         std::cerr << "Unable to open output file\n";
         return 1;
       }
+    } else if (arg.starts_with("--manifest=")) {
+      arg.remove_prefix(sizeof("--manifest=")-1);
+      manifest.open(arg.data(), std::ios_base::out);
+      if (!manifest.is_open()) {
+        std::cerr << "Unable to open manifest file\n";
+        return 1;
+      }
     } else break;
     ++argv; --argc;
   }
@@ -49,11 +59,11 @@ int main(int argc, char const* argv[]) try {
     std::cerr << "Invalid usage. You need something like './package controller Snapmaker_Vx.y.z'\n";
     return 1;
   }
-  char header[2048] = {};
+  std::uint8_t type;
   if (argv[1] == "0"sv || argv[1] == "controller"sv)
-    header[0] = 0;
+    type = 0;
   else if (argv[1] == "1"sv || argv[1] == "module"sv)
-    header[0] = 1;
+    type = 1;
   else {
     std::cerr << "Unsupported type\n";
     return 1;
@@ -67,7 +77,6 @@ int main(int argc, char const* argv[]) try {
     std::cerr << "Version too long (should have at most 32 bytes)\n";
     return 1;
   }
-  std::copy(version.begin(), version.end(), header + 5);
   std::string arg3, arg4;
   if(argv[3]) {
     arg3 = argv[3];
@@ -75,15 +84,31 @@ int main(int argc, char const* argv[]) try {
   } else { // Default to the numbers used in the official updates
     arg3 = "0"; arg4 = "20";
   }
-  *reinterpret_cast<std::uint16_t*>(header + 1) = htobe16(std::stoul(arg3));
-  *reinterpret_cast<std::uint16_t*>(header + 3) = htobe16(std::stoul(arg4));
+  std::uint16_t start_id = std::stoul(arg3), end_id = std::stoul(arg4);
 
-  std::ostringstream sstr;
-  sstr << (input.is_open() ? (input) : (std::cin)).rdbuf();
-  auto content = sstr.str();
-  *reinterpret_cast<std::uint32_t*>(header + 40) = htole32(content.size()); // No, this does not have to be in big endian. Yes, I appreciate the consistency too...
-  *reinterpret_cast<std::uint32_t*>(header + 44) = htole32(std::accumulate((std::uint8_t*)content.data(), (std::uint8_t*)content.data() + content.size(), std::uint32_t(0)));
-  *reinterpret_cast<std::uint32_t*>(header + 48) = htole32(flags);
+  // Checksum (and hash if requested) every chunk right after reading it, so the input is only touched once.
+  std::string content;
+  std::uint32_t checksum = 0;
+  Sha256 image_digest;
+  {
+    auto &in = input.is_open() ? (input) : (std::cin);
+    constexpr std::size_t chunk_size = 0x10000;
+    do {
+      auto offset = content.size();
+      content.resize(offset + chunk_size);
+      in.read(content.data() + offset, chunk_size);
+      content.resize(offset + in.gcount());
+      auto chunk = std::span<const char>{content}.subspan(offset);
+      checksum = packetChecksum(chunk, checksum);
+      if (manifest.is_open())
+        image_digest.update(chunk);
+    } while (in);
+  }
+  char header[packetHeaderSize];
+  buildPacketHeader(header, type, version, start_id, end_id, content.size(), checksum, flags);
+
+  Sha256 packet_digest;
+  std::string packet_sha256;
 
   if (output.is_open() || !flash_interface) {
     auto &out = [&]() -> std::ostream& {
@@ -92,8 +117,29 @@ int main(int argc, char const* argv[]) try {
       else
         return std::cout;
     }();
-    out.write(header, sizeof header);
-    out << content;
+    auto digest = manifest.is_open() ? &packet_digest : nullptr;
+    write_hashed(out, std::span{header}, {digest});
+    write_hashed(out, content, {digest});
+    if (digest)
+      packet_sha256 = packet_digest.hex();
+  } else if (manifest.is_open()) {
+    packet_digest.update(std::span{header});
+    packet_digest.update(content);
+    packet_sha256 = packet_digest.hex();
+  }
+  if (manifest.is_open()) {
+    manifest << "{\n"
+             << "  \"type\": " << (type ? "\"module\"" : "\"controller\"") << ",\n"
+             << "  \"version\": " << json_string(version) << ",\n"
+             << "  \"start_id\": " << start_id << ",\n"
+             << "  \"end_id\": " << end_id << ",\n"
+             << "  \"flags\": " << flags << ",\n"
+             << "  \"image_size\": " << content.size() << ",\n"
+             << "  \"checksum\": " << checksum << ",\n"
+             << "  \"image_sha256\": \"" << image_digest.hex() << "\",\n"
+             << "  \"size\": " << sizeof header + content.size() << ",\n"
+             << "  \"sha256\": \"" << packet_sha256 << "\"\n"
+             << "}\n";
   }
   if (flash_interface) {
 #ifdef HAS_SERIAL
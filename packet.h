@@ -0,0 +1,31 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <span>
+#include <string_view>
+
+#include "endian-helper.h"
+
+// Every controller/module firmware image is prefixed with this header (see package.cpp).
+constexpr std::size_t packetHeaderSize = 2048;
+
+inline std::uint32_t packetChecksum(std::span<const char> data, std::uint32_t sum = 0) noexcept {
+  return std::accumulate((const std::uint8_t*)data.data(), (const std::uint8_t*)data.data() + data.size(), sum);
+}
+
+inline void buildPacketHeader(std::span<char, packetHeaderSize> header, std::uint8_t type, std::string_view version,
+                              std::uint16_t start_id, std::uint16_t end_id,
+                              std::uint32_t size, std::uint32_t checksum, std::uint32_t flags) {
+  if(version.size() > 32)
+    throw "Version too long (should have at most 32 bytes)";
+  std::fill(header.begin(), header.end(), 0);
+  header[0] = type;
+  *reinterpret_cast<std::uint16_t*>(header.data() + 1) = htobe16(start_id);
+  *reinterpret_cast<std::uint16_t*>(header.data() + 3) = htobe16(end_id);
+  std::copy(version.begin(), version.end(), header.begin() + 5);
+  *reinterpret_cast<std::uint32_t*>(header.data() + 40) = htole32(size); // No, this does not have to be in big endian. Yes, I appreciate the consistency too...
+  *reinterpret_cast<std::uint32_t*>(header.data() + 44) = htole32(checksum);
+  *reinterpret_cast<std::uint32_t*>(header.data() + 48) = htole32(flags);
+}
@@ -0,0 +1,122 @@
+#ifndef SHA256_HELPER
+#define SHA256_HELPER
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string>
+
+// Minimal incremental SHA-256 (FIPS 180-4), so the tools can hash data while
+// they are reading or writing it without depending on a crypto library.
+class Sha256 {
+  public:
+    using Digest = std::array<std::uint8_t, 32>;
+
+    void update(std::span<const char> data) noexcept {
+      auto ptr = reinterpret_cast<const std::uint8_t*>(data.data());
+      std::size_t len = data.size();
+      length += len;
+      if (buffered) {
+        std::size_t fill = std::min(len, block.size() - buffered);
+        std::memcpy(block.data() + buffered, ptr, fill);
+        buffered += fill; ptr += fill; len -= fill;
+        if (buffered != block.size())
+          return;
+        compress(block.data());
+        buffered = 0;
+      }
+      for (; len >= block.size(); ptr += block.size(), len -= block.size())
+        compress(ptr);
+      std::memcpy(block.data(), ptr, len);
+      buffered = len;
+    }
+
+    // Works on a copy, so more data can still be added and finish() may be called repeatedly
+    Digest finish() const noexcept {
+      Sha256 copy = *this;
+      return copy.pad();
+    }
+
+    std::string hex() const {
+      constexpr char digits[] = "0123456789abcdef";
+      std::string result;
+      for (auto byte : finish()) {
+        result += digits[byte >> 4];
+        result += digits[byte & 0xf];
+      }
+      return result;
+    }
+
+    static std::string hex(std::span<const char> data) {
+      Sha256 sha;
+      sha.update(data);
+      return sha.hex();
+    }
+
+  private:
+    Digest pad() noexcept {
+      std::uint64_t bits = length * 8;
+      block[buffered++] = 0x80;
+      if (buffered > 56) {
+        std::fill(block.begin() + buffered, block.end(), 0);
+        compress(block.data());
+        buffered = 0;
+      }
+      std::fill(block.begin() + buffered, block.begin() + 56, 0);
+      for (int i = 0; i != 8; ++i)
+        block[63 - i] = bits >> (8 * i);
+      compress(block.data());
+      Digest digest;
+      for (int i = 0; i != 8; ++i)
+        for (int j = 0; j != 4; ++j)
+          digest[4 * i + j] = state[i] >> (24 - 8 * j);
+      return digest;
+    }
+
+    static constexpr std::uint32_t rotr(std::uint32_t x, int n) noexcept {
+      return (x >> n) | (x << (32 - n));
+    }
+
+    void compress(const std::uint8_t *chunk) noexcept {
+      static constexpr std::uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+      };
+      std::uint32_t w[64];
+      for (int i = 0; i != 16; ++i)
+        w[i] = std::uint32_t(chunk[4 * i]) << 24 | std::uint32_t(chunk[4 * i + 1]) << 16
+             | std::uint32_t(chunk[4 * i + 2]) << 8 | std::uint32_t(chunk[4 * i + 3]);
+      for (int i = 16; i != 64; ++i) {
+        std::uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        std::uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+      }
+      auto [a, b, c, d, e, f, g, h] = state;
+      for (int i = 0; i != 64; ++i) {
+        std::uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        std::uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+      }
+      state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+      state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+    std::array<std::uint32_t, 8> state {{
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    }};
+    std::array<std::uint8_t, 64> block;
+    std::size_t buffered = 0;
+    std::uint64_t length = 0;
+};
+
+#endif
@@ -1,16 +1,18 @@
 #include <cstdint>
 #include <sstream>
 #include <vector>
+#include <optional>
 #include <array>
 #include <span>
 #include <string_view>
 #include <iostream>
 #include <fstream>
+#include <filesystem>
 #if __has_include(<format>)
 #include <format>
 constexpr auto operator ""_format(const char *str, std::size_t len) {
   return [=](auto ...args) {
-    return std::format({str, len}, std::forward<decltype(args)>(args)...);
+    return std::vformat(std::string_view{str, len}, std::make_format_args(args...));
   };
 }
 #else
@@ -18,207 +20,17 @@ constexpr auto operator ""_format(const char *str, std::size_t len) {
 /* using namespace fmt; */
 constexpr auto operator ""_format(const char *str, std::size_t len) {
   return [=](auto ...args) {
-    return fmt::format(std::string_view{str, len}, std::forward<decltype(args)>(args)...);
+    return fmt::format(fmt::runtime(std::string_view{str, len}), std::forward<decltype(args)>(args)...);
   };
 }
 #endif
 #include "endian-helper.h"
+#include "bundle.h"
+#include "input_loader.h"
+#include "manifest-helper.h"
 
 using namespace std::literals::string_view_literals;
 using namespace fmt;
-struct Header {
-  enum class Type {
-    Controller = 0,
-    Module = 1,
-    Screen = 2
-  };
-  struct Entry {
-    Type type;
-    std::uint32_t offset;
-    std::uint32_t size;
-  };
-  std::string version;
-  std::uint32_t flags;
-  std::vector<Entry> entries;
-};
-
-struct Update {
-  std::string version;
-  std::uint32_t flags = 0;
-  std::optional<std::vector<char>> screen;
-  std::optional<std::vector<char>> controller;
-  std::vector<std::vector<char>> modules;
-};
-
-constexpr std::size_t headerSize(std::size_t entries) noexcept {
-  return 2 + 32 + 4 + 1 + 9 * entries;
-}
-
-Header parseHeader(std::span<const char> buffer) {
-  if(buffer.size() < headerSize(0))
-    throw "Buffer too small to contain header";
-  auto iter = buffer.begin();
-  std::uint16_t length = be16toh(*(std::uint16_t*)&*iter);
-  if(length > buffer.size())
-    throw "Header length exceeds buffer size";
-  iter += 2; length -= 2;
-
-  Header header;
-
-  header.version = [&] {
-    auto end_iter = iter + 32;
-    while(end_iter != iter && !*(end_iter - 1))
-      --end_iter;
-    return std::string(iter, end_iter);
-  }();
-  iter += 32; length -= 32;
-
-  header.flags = be32toh(*(std::uint32_t*)&*iter);
-  iter += 4; length -= 4;
-
-  header.entries.resize(*iter);
-  iter += 1; length -= 1;
-  if (length < header.entries.size() * 9)
-    throw "Too many entries for specified header size";
-  for (Header::Entry &entry : header.entries) {
-    entry.type = Header::Type(*iter);
-    iter += 1;
-    entry.offset = be32toh(*(std::uint32_t*)&*iter);
-    iter += 4; length -= 4;
-    entry.size = be32toh(*(std::uint32_t*)&*iter);
-    iter += 4; length -= 4;
-  }
-  return header;
-}
-Update parseUpdate(std::span<const char> buffer) {
-  Update update;
-  auto header = parseHeader(buffer);
-  update.version = std::move(header.version);
-  update.flags = header.flags;
-  for (auto &&entry : header.entries) {
-    if (entry.offset + entry.size > buffer.size())
-      throw "Length inconsistency detected";
-    auto &container = [&](Header::Type type) -> auto& {
-      switch(type) {
-        case Header::Type::Controller:
-          if (update.controller)
-            throw "Duplicate Controller packet";
-          return update.controller.emplace();
-        case Header::Type::Module:
-          update.modules.emplace_back();
-          return update.modules.back();
-        case Header::Type::Screen:
-          if (update.screen)
-            throw "Duplicate Screen packet";
-          return update.screen.emplace();
-        default: throw "Unknown entry type";
-      }
-    }(entry.type);
-    container.resize(entry.size);
-    auto begin_iter = buffer.begin() + entry.offset;
-    std::copy(begin_iter, begin_iter + entry.size, container.begin());
-  }
-  return update;
-}
-
-std::size_t getSize(const Update &update) {
-  std::size_t size = 0;
-  std::size_t packets = update.modules.size();
-  for (auto &&module : update.modules) {
-    size += module.size();
-  }
-  if (update.controller) {
-    size += update.controller->size(); ++packets;
-  }
-  if (update.screen) {
-    size += update.screen->size(); ++packets;
-  }
-  return size + headerSize(packets);
-}
-std::span<char> serialize(const Header &header, std::span<char> buffer) {
-  auto header_size = headerSize(header.entries.size());
-  if (buffer.size() < header_size)
-    throw "Buffer too small to hold header";
-  if (header.version.size() > 32)
-    throw "Version too long";
-  if (header.entries.size() >= 0x100)
-    throw "Too many entries in update header";
-  *reinterpret_cast<std::uint16_t*>(buffer.data()) = htobe16(header_size);
-  buffer = buffer.subspan<2>();
-  std::fill(
-      std::copy(header.version.begin(), header.version.end(), buffer.begin()),
-      buffer.begin() + 32,
-      0);
-  buffer = buffer.subspan<32>();
-  *reinterpret_cast<std::uint32_t*>(buffer.data()) = htobe32(header.flags);
-  buffer = buffer.subspan<4>();
-  buffer.front() = header.entries.size();
-  buffer = buffer.subspan<1>();
-  for (auto &&entry : header.entries) {
-    buffer.front() = (char)entry.type;
-    buffer = buffer.subspan<1>();
-    *reinterpret_cast<std::uint32_t*>(buffer.data()) = htobe32(entry.offset);
-    buffer = buffer.subspan<4>();
-    *reinterpret_cast<std::uint32_t*>(buffer.data()) = htobe32(entry.size);
-    buffer = buffer.subspan<4>();
-  }
-  return buffer;
-}
-std::span<char> serialize(const Update &update, std::span<char> buffer) {
-  Header header;
-  header.version = update.version;
-  header.flags = update.flags;
-  std::uint32_t offset = headerSize(update.modules.size() + (update.controller?1:0) + (update.screen?1:0));
-  for (auto &&module : update.modules) {
-    header.entries.push_back(Header::Entry(Header::Type::Module, offset, module.size()));
-    offset += module.size();
-  }
-  if (update.controller) {
-    header.entries.push_back(Header::Entry(Header::Type::Controller, offset, update.controller->size()));
-    offset += update.controller->size();
-  }
-  if (update.screen) {
-    header.entries.push_back(Header::Entry(Header::Type::Screen, offset, update.screen->size()));
-    offset += update.screen->size();
-  }
-  if (buffer.size() < offset)
-    throw "Buffer too small to hold update";
-  buffer = serialize(header, buffer);
-  for (auto &&module : update.modules) {
-    std::copy(module.begin(), module.end(), buffer.begin());
-    buffer = buffer.subspan(module.size());
-  }
-  if (update.controller) {
-    std::copy(update.controller->begin(), update.controller->end(), buffer.begin());
-    buffer = buffer.subspan(update.controller->size());
-  }
-  if (update.screen) {
-    std::copy(update.screen->begin(), update.screen->end(), buffer.begin());
-    buffer = buffer.subspan(update.screen->size());
-  }
-  return buffer;
-}
-std::vector<char> serialize(const Update &update) {
-  std::vector<char> buffer(getSize(update));
-  serialize(update, buffer);
-  return buffer;
-}
-
-auto read_file(const char *filename) {
-  std::vector<char> buffer(0x1000);
-  std::ifstream file(filename, std::ios_base::in | std::ios_base::binary);
-  while(file.read(buffer.data() + (buffer.size() - 0x1000), 0x1000))
-    buffer.resize(buffer.size() + 0x1000);
-  buffer.resize(buffer.size() - 0x1000 + file.gcount());
-  return buffer;
-}
-
-void write_file(const char *filename, const std::vector<char> &data) {
-  std::ofstream file(filename, std::ios_base::out | std::ios_base::binary);
-  if (!file)
-    throw "Unable to open output file\n";
-  file.write(data.data(), data.size());
-}
 
 int main(int argc, char const* argv[])
 try {
@@ -246,45 +58,146 @@ try {
     default:
       {
         Update update;
+        // The bundle is written to a temporary file which only replaces the --output= file once it is complete,
+        // since we start writing before all inputs have been read. (On stdout a failure can leave partial output.)
+        struct PartialOutput {
+          std::string path, temp_path;
+          ~PartialOutput() {
+            std::error_code ec;
+            if (!temp_path.empty())
+              std::filesystem::remove(temp_path, ec);
+          }
+        } partial;
         std::ofstream output;
+        std::ofstream manifest;
         while(argv[1]) {
           std::string_view arg = argv[1];
           if (arg == "--force"sv)
             update.flags = 1;
           else if (arg.starts_with("--output=")) {
             arg.remove_prefix(sizeof("--output=")-1);
-            output.open(arg.data(), std::ios_base::out | std::ios_base::binary);
+            partial.path = arg;
+            partial.temp_path = partial.path + ".part";
+            output.open(partial.temp_path, std::ios_base::out | std::ios_base::binary);
             if (!output.is_open()) {
+              partial.temp_path.clear();
               std::cerr << "Unable to open output file\n";
               return 1;
             }
+          } else if (arg.starts_with("--manifest=")) {
+            arg.remove_prefix(sizeof("--manifest=")-1);
+            manifest.open(arg.data(), std::ios_base::out);
+            if (!manifest.is_open()) {
+              std::cerr << "Unable to open manifest file\n";
+              return 1;
+            }
           } else break;
           ++argv; --argc;
         }
+        // The options might have consumed all arguments
+        if (argc < 3) {
+          std::cerr << "Invalid usage\n";
+          return 1;
+        }
         if (argv[1] == "--force"sv) {
           update.flags = 1; ++argv; --argc;
           if (argc == 2) {
             std::cerr << "Invalid usage\n";
             return 1;
           }
-        } else
-          update.flags = 0;
+        }
         update.version = argv[1];
-        for (int i = 2; i != argc; ++i) {
-          auto content = read_file(argv[i]);
-          if (content.empty())
+        // All inputs are loaded concurrently. Since the sizes are known up front, we can write the header as soon
+        // as the types are known and every component as soon as it (and everything before it) has been read.
+        InputLoader inputs(std::span{argv + 2, std::size_t(argc - 2)});
+        std::vector<std::size_t> modules;
+        std::optional<std::size_t> controller, screen;
+        for (std::size_t i = 0; i != inputs.size(); ++i) {
+          auto head = inputs.head(i);
+          if (head.empty())
             std::cerr << "Skipping empty input file\n";
           else
-            switch (content[0]) {
-              case 0: update.controller = std::move(content); break;
-              case 'P': update.screen = std::move(content); break;
-              case 1: update.modules.push_back(std::move(content)); break;
+            switch (head[0]) {
+              case 0: controller = i; break;
+              case 'P': screen = i; break;
+              case 1: modules.push_back(i); break;
               default: throw "Invalid input file\n";
             }
         }
-        auto buffer = serialize(update);
+        // Type and input index of every component, in the same order as makeHeader(const Update&) lists them.
+        std::vector<std::pair<Header::Type, std::size_t>> components;
+        for (auto i : modules)
+          components.emplace_back(Header::Type::Module, i);
+        if (controller)
+          components.emplace_back(Header::Type::Controller, *controller);
+        if (screen)
+          components.emplace_back(Header::Type::Screen, *screen);
+        std::vector<Header::Entry> entries;
+        std::vector<std::size_t> order;
+        for (auto [type, i] : components) {
+          entries.push_back(Header::Entry(type, 0, inputs.file_size(i)));
+          order.push_back(i);
+        }
+        inputs.prioritize(order);
+        auto header = makeHeader(update.version, update.flags, std::move(entries));
 
-        (output.is_open() ? output : std::cout).write(buffer.data(), buffer.size());
+        auto &out = output.is_open() ? output : std::cout;
+        Sha256 bundle_digest;
+        auto bundle_digest_ptr = manifest.is_open() ? &bundle_digest : nullptr;
+        std::vector<std::string> digests;
+        std::vector<char> header_buffer(headerSize(header.entries.size()));
+        serialize(header, header_buffer);
+        write_hashed(out, header_buffer, {bundle_digest_ptr});
+        std::size_t size = header_buffer.size();
+        for (std::size_t i = 0; i != components.size(); ++i) {
+          auto &content = inputs.get(components[i].second);
+          Sha256 digest;
+          write_hashed(out, content, {bundle_digest_ptr, manifest.is_open() ? &digest : nullptr});
+          if (manifest.is_open())
+            digests.push_back(digest.hex());
+          size += content.size();
+        }
+        if (!out.flush())
+          throw "Unable to write output file";
+        if (output.is_open()) {
+          output.close();
+          std::filesystem::rename(partial.temp_path, partial.path);
+          partial.temp_path.clear();
+        }
+
+        if (manifest.is_open()) {
+          manifest << "{\n"
+                   << "  \"version\": " << json_string(update.version) << ",\n"
+                   << "  \"flags\": " << update.flags << ",\n"
+                   << "  \"size\": " << size << ",\n"
+                   << "  \"sha256\": \"" << bundle_digest.hex() << "\",\n"
+                   << "  \"components\": [";
+          for (std::size_t i = 0; i != header.entries.size(); ++i) {
+            auto &entry = header.entries[i];
+            manifest << (i ? "," : "") << "\n    {\n"
+                     << "      \"type\": " << (entry.type == Header::Type::Controller ? "\"controller\""
+                                              : entry.type == Header::Type::Module ? "\"module\"" : "\"screen\"") << ",\n"
+                     << "      \"file\": " << json_string(argv[2 + components[i].second]) << ",\n"
+                     << "      \"offset\": " << entry.offset << ",\n"
+                     << "      \"size\": " << entry.size << ",\n";
+            // Controller and module packets start with the 2048 byte header written by `package`
+            if (entry.type != Header::Type::Screen && entry.size >= 2048) {
+              auto packet = inputs.get(components[i].second).data();
+              auto version_end = packet + 37;
+              while (version_end != packet + 5 && !*(version_end - 1))
+                --version_end;
+              manifest << "      \"version\": " << json_string({packet + 5, version_end}) << ",\n"
+                       << "      \"start_id\": " << be16toh(*reinterpret_cast<const std::uint16_t*>(packet + 1)) << ",\n"
+                       << "      \"end_id\": " << be16toh(*reinterpret_cast<const std::uint16_t*>(packet + 3)) << ",\n"
+                       << "      \"flags\": " << le32toh(*reinterpret_cast<const std::uint32_t*>(packet + 48)) << ",\n"
+                       << "      \"image_size\": " << le32toh(*reinterpret_cast<const std::uint32_t*>(packet + 40)) << ",\n"
+                       << "      \"checksum\": " << le32toh(*reinterpret_cast<const std::uint32_t*>(packet + 44)) << ",\n";
+            }
+            manifest << "      \"sha256\": \"" << digests[i] << "\"\n"
+                     << "    }";
+          }
+          manifest << "\n  ]\n}\n";
+        }
       }
   }
   return 0;